@@ -0,0 +1,160 @@
+#ifndef FFT_H
+#define FFT_H
+
+#include <math.h>
+#include <complex>
+#include <vector>
+
+// A small mixed radix FFT, decimation in time after KISS FFT, and the
+// DCT-II built on top of it. Works for any length, and is fastest when
+// the length factors into 2, 3 and 5 like most grid sizes do.
+
+typedef std::complex<float> cfloat;
+
+struct FFTPlan {
+	int n;
+	std::vector<int> factors;     // (radix, remaining length) pairs
+	std::vector<cfloat> twiddles; // exp(-2 pi i k/n)
+	std::vector<cfloat> shift;    // exp(-pi i k/2n) for the DCT
+	std::vector<cfloat> scratch, a, b;
+};
+
+void PlanFFT(FFTPlan &plan, int n) {
+	plan.n = n;
+	plan.factors.clear();
+	for (int m = n, p = 4; m > 1; ) {
+		while (m % p) {
+			p = p == 4 ? 2 : p == 2 ? 3 : p + 2;
+			if (p * p > m) p = m;
+		}
+		m /= p;
+		plan.factors.push_back(p);
+		plan.factors.push_back(m);
+	}
+	plan.twiddles.resize(n);
+	plan.shift.resize(n);
+	for (int k = 0; k < n; k++) {
+		plan.twiddles[k] = std::polar(1.0, -2 * M_PI * k / n);
+		plan.shift[k] = std::polar(1.0, -M_PI * k / (2.0 * n));
+	}
+	plan.scratch.resize(n);
+	plan.a.resize(n);
+	plan.b.resize(n);
+}
+
+static void Butterfly2(FFTPlan &plan, cfloat *out, int fstride, int m) {
+	const cfloat *tw = &plan.twiddles[0];
+	for (int u = 0; u < m; u++) {
+		cfloat t = out[m+u] * tw[u * fstride];
+		out[m+u] = out[u] - t;
+		out[u] += t;
+	}
+}
+
+static void Butterfly3(FFTPlan &plan, cfloat *out, int fstride, int m) {
+	const cfloat *tw = &plan.twiddles[0];
+	float epi3 = tw[fstride * m].imag();
+	for (int u = 0; u < m; u++) {
+		cfloat s1 = out[m+u] * tw[u * fstride], s2 = out[2*m+u] * tw[2 * u * fstride];
+		cfloat s3 = s1 + s2, s0 = (s1 - s2) * epi3;
+		cfloat mid = out[u] - 0.5f * s3;
+		out[u] += s3;
+		out[2*m+u] = cfloat(mid.real() + s0.imag(), mid.imag() - s0.real());
+		out[m+u] = cfloat(mid.real() - s0.imag(), mid.imag() + s0.real());
+	}
+}
+
+static void Butterfly4(FFTPlan &plan, cfloat *out, int fstride, int m) {
+	const cfloat *tw = &plan.twiddles[0];
+	for (int u = 0; u < m; u++) {
+		cfloat s0 = out[m+u] * tw[u * fstride];
+		cfloat s1 = out[2*m+u] * tw[2 * u * fstride];
+		cfloat s2 = out[3*m+u] * tw[3 * u * fstride];
+		cfloat s5 = out[u] - s1, s3 = s0 + s2, s4 = s0 - s2;
+		out[u] += s1;
+		out[2*m+u] = out[u] - s3;
+		out[u] += s3;
+		out[m+u] = cfloat(s5.real() + s4.imag(), s5.imag() - s4.real());
+		out[3*m+u] = cfloat(s5.real() - s4.imag(), s5.imag() + s4.real());
+	}
+}
+
+// Any other radix, O(p^2) per group
+static void ButterflyN(FFTPlan &plan, cfloat *out, int fstride, int p, int m) {
+	cfloat *scratch = &plan.scratch[0];
+	for (int u = 0; u < m; u++) {
+		for (int q = 0, k = u; q < p; q++, k += m) scratch[q] = out[k];
+		for (int q1 = 0, k = u; q1 < p; q1++, k += m) {
+			cfloat sum = scratch[0];
+			for (int q = 1, t = 0; q < p; q++) {
+				t += fstride * k;
+				if (t >= plan.n) t -= plan.n;
+				sum += scratch[q] * plan.twiddles[t];
+			}
+			out[k] = sum;
+		}
+	}
+}
+
+static void FFTWork(FFTPlan &plan, cfloat *out, const cfloat *in, int fstride, const int *factors) {
+	int p = factors[0], m = factors[1];
+	if (m == 1) {
+		for (int k = 0; k < p; k++) out[k] = in[k * fstride];
+	} else {
+		for (int k = 0; k < p; k++) FFTWork(plan, out + k*m, in + k*fstride, fstride * p, factors + 2);
+	}
+	switch (p) {
+		case 2: Butterfly2(plan, out, fstride, m); break;
+		case 3: Butterfly3(plan, out, fstride, m); break;
+		case 4: Butterfly4(plan, out, fstride, m); break;
+		default: ButterflyN(plan, out, fstride, p, m); break;
+	}
+}
+
+// Forward transform, out must not alias in
+void FFT(FFTPlan &plan, cfloat *out, const cfloat *in) {
+	if (plan.n == 1) out[0] = in[0];
+	else FFTWork(plan, out, in, 1, &plan.factors[0]);
+}
+
+// X[k] = sum x[i] cos(pi k (2i + 1) / 2n), for two sequences at once
+// packed into the real and imaginary parts of one FFT. Reads and writes
+// with strides, and may work in place or be given the same sequence twice.
+void DCT(FFTPlan &plan, const float *x0, const float *x1, int xstride, float *X0, float *X1, int Xstride) {
+	int n = plan.n;
+	cfloat *v = &plan.a[0], *V = &plan.b[0];
+	for (int i = 0; 2*i < n; i++) v[i] = cfloat(x0[2*i * xstride], x1[2*i * xstride]);
+	for (int i = 0; 2*i + 1 < n; i++) v[n-1-i] = cfloat(x0[(2*i + 1) * xstride], x1[(2*i + 1) * xstride]);
+	FFT(plan, V, v);
+	for (int k = 0; k < n; k++) {
+		cfloat a = V[k], b = std::conj(V[k == 0 ? 0 : n-k]);
+		cfloat V0 = 0.5f * (a + b), V1 = cfloat(0, -0.5f) * (a - b);
+		X0[k * Xstride] = (V0 * plan.shift[k]).real();
+		X1[k * Xstride] = (V1 * plan.shift[k]).real();
+	}
+}
+
+// Exact inverse of DCT above
+void IDCT(FFTPlan &plan, const float *X0, const float *X1, int Xstride, float *x0, float *x1, int xstride) {
+	int n = plan.n;
+	cfloat *Z = &plan.a[0], *v = &plan.b[0];
+	for (int k = 0; k < n; k++) {
+		int r = (n-k) * Xstride;
+		cfloat V0 = cfloat(X0[k * Xstride], k == 0 ? 0 : -X0[r]);
+		cfloat V1 = cfloat(X1[k * Xstride], k == 0 ? 0 : -X1[r]);
+		// Inverse FFT by conjugating on the way in and out
+		Z[k] = std::conj(std::conj(plan.shift[k]) * (V0 + cfloat(0, 1) * V1));
+	}
+	FFT(plan, v, Z);
+	float scale = 1.0f / n;
+	for (int i = 0; 2*i < n; i++) {
+		x0[2*i * xstride] = v[i].real() * scale;
+		x1[2*i * xstride] = -v[i].imag() * scale;
+	}
+	for (int i = 0; 2*i + 1 < n; i++) {
+		x0[(2*i + 1) * xstride] = v[n-1-i].real() * scale;
+		x1[(2*i + 1) * xstride] = -v[n-1-i].imag() * scale;
+	}
+}
+
+#endif
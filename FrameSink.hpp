@@ -0,0 +1,125 @@
+#ifndef FRAME_SINK_H
+#define FRAME_SINK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+extern "C" {
+	#include "RGBE.h"
+};
+
+// Where the density frames go. HDR writes one .hdr per frame using the
+// path as a prefix, the rest stream every frame into a single file (or
+// stdout for "-") so an encoder can read them straight from a pipe:
+//   ffmpeg -i - out.mp4                               (.y4m or -)
+//   ffmpeg -f rawvideo -pix_fmt grayf32le -s WxH -i - (.f32)
+//   ffmpeg -f rawvideo -pix_fmt gray16le -s WxH -i -  (.u16)
+enum SinkFormat { SINK_HDR, SINK_Y4M, SINK_F32, SINK_U16 };
+
+struct FrameSink {
+	FILE *f;
+	const char *path;
+	int format, width, height;
+	int every, frame, written;
+	bool failed;
+	std::vector<unsigned char> buffer;
+};
+
+const size_t SINK_BUFFER = 1 << 22;
+
+static bool HasSuffix(const char *path, const char *suffix) {
+	size_t n = strlen(path), m = strlen(suffix);
+	return n >= m && strcmp(path + n - m, suffix) == 0;
+}
+
+// Keeps every 'every'th frame. Returns false if the stream couldn't be opened.
+bool OpenSink(FrameSink &sink, const char *path, int width, int height, int every) {
+	sink.f = NULL;
+	sink.path = path;
+	sink.width = width;
+	sink.height = height;
+	sink.every = every < 1 ? 1 : every;
+	sink.frame = sink.written = 0;
+	sink.failed = false;
+
+	if (strcmp(path, "-") == 0 || HasSuffix(path, ".y4m")) sink.format = SINK_Y4M;
+	else if (HasSuffix(path, ".f32")) sink.format = SINK_F32;
+	else if (HasSuffix(path, ".u16")) sink.format = SINK_U16;
+	else sink.format = SINK_HDR;
+
+	switch (sink.format) {
+		case SINK_HDR: sink.buffer.resize(width * height * 3 * sizeof(float)); return true;
+		case SINK_Y4M: sink.buffer.resize(width * height); break;
+		case SINK_F32: sink.buffer.resize(width * height * sizeof(float)); break;
+		case SINK_U16: sink.buffer.resize(width * height * 2); break;
+	}
+
+	sink.f = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+	if (sink.f == NULL) return false;
+	setvbuf(sink.f, NULL, _IOFBF, SINK_BUFFER);
+	if (sink.format == SINK_Y4M) {
+		fprintf(sink.f, "YUV4MPEG2 W%i H%i F60:1 Ip A1:1 Cmono\n", width, height);
+	}
+	return true;
+}
+
+// Reports the first failed write and stops writing after it, so a full
+// disk or a closed pipe isn't silently truncated output
+static void SinkFailed(FrameSink &sink, const char *name) {
+	if (!sink.failed) fprintf(stderr, "Error: could not write %s after %i frames\n", name, sink.written);
+	sink.failed = true;
+}
+
+static unsigned Quantize(float x, float scale) {
+	return x <= 0 ? 0 : x >= 1 ? (unsigned) scale : (unsigned) (x * scale + 0.5f);
+}
+
+// Takes width*height densities, row major
+void WriteFrame(FrameSink &sink, const float *gray) {
+	if (sink.failed || sink.frame++ % sink.every != 0) return;
+	int n = sink.width * sink.height;
+	unsigned char *out = &sink.buffer[0];
+
+	switch (sink.format) {
+		case SINK_HDR: {
+			float *rgb = (float *) out;
+			for (int i = 0; i < n; i++) {
+				rgb[3*i] = rgb[3*i + 1] = rgb[3*i + 2] = gray[i];
+			}
+			char name[1024];
+			sprintf(name, "%s%i.hdr", sink.path, sink.written + 1);
+			FILE *f = fopen(name, "wb");
+			if (f == NULL) return SinkFailed(sink, name);
+			bool ok = RGBE_WriteHeader(f, sink.width, sink.height, NULL) == RGBE_RETURN_SUCCESS &&
+					  RGBE_WritePixels_RLE(f, rgb, sink.width, sink.height) == RGBE_RETURN_SUCCESS;
+			if (fclose(f) != 0 || !ok) return SinkFailed(sink, name);
+			sink.written++;
+			return;
+		}
+		case SINK_Y4M:
+			if (fputs("FRAME\n", sink.f) == EOF) return SinkFailed(sink, sink.path);
+			for (int i = 0; i < n; i++) out[i] = Quantize(gray[i], 255);
+			break;
+		case SINK_F32:
+			memcpy(out, gray, n * sizeof(float));
+			break;
+		case SINK_U16:
+			for (int i = 0; i < n; i++) {
+				unsigned q = Quantize(gray[i], 65535);
+				out[2*i] = q & 0xff;
+				out[2*i + 1] = q >> 8;
+			}
+			break;
+	}
+	if (fwrite(out, 1, sink.buffer.size(), sink.f) != sink.buffer.size()) return SinkFailed(sink, sink.path);
+	sink.written++;
+}
+
+void CloseSink(FrameSink &sink) {
+	if (sink.f == NULL) return;
+	int rc = sink.f == stdout ? fflush(sink.f) : fclose(sink.f);
+	if (rc != 0) SinkFailed(sink, sink.path);
+	sink.f = NULL;
+}
+
+#endif
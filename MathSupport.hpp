@@ -17,4 +17,18 @@ float saturate(float x) {
 	return std::max(0.0f, std::min(1.0f, x));
 }
 
+static unsigned long long SplitMix(unsigned long long z) {
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Counter-based random numbers, the same for a given cell and stream no
+// matter which thread asks for them or in what order
+unsigned CellRandom(int x, int y, int stream, unsigned seed) {
+	unsigned long long key = SplitMix((unsigned long long) seed << 32 | (unsigned) stream);
+	return SplitMix(key ^ ((unsigned long long) (unsigned) x << 32 | (unsigned) y)) >> 32;
+}
+
 #endif
\ No newline at end of file
@@ -8,11 +8,23 @@
 #include <math.h>
 #include <algorithm>
 #include <utility>
+#include <vector>
 #include <time.h>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 #include "MathSupport.hpp"
-extern "C" {
-	#include "RGBE.h"
-};
+#include "FrameSink.hpp"
+#include "FFT.hpp"
 
 /******************************************* USER CHANGES GO HERE ***********************************************/
 
@@ -23,6 +35,24 @@ extern "C" {
 // Constants
 const int width = 384, height = 216, upscale = 3;
 const float diff = 0.0, visc = 0.0;
+// Worker processes the grid is split between, each owning a strip of rows
+const int workers = 1;
+// Optional width x height .hdr mask, bright pixels are solid obstacles
+const char *maskfile = NULL;
+// Pressure solve, SPECTRAL is exact but needs a domain without obstacles,
+// CG starts from last frame's pressure and stops at the relative residual
+enum PressureSolver { RELAX, SPECTRAL, CG };
+const PressureSolver pressure = RELAX;
+const float tolerance = 1e-3;
+const int maxiter = 200;
+// Optional initial state instead of the functions below. A .hdr gives the
+// density, any other file is raw width x height float planes: density, or
+// density, u and v.
+const char *statefile = NULL;
+const unsigned seed = 1;
+// Dragging the mouse with the left button pushes the fluid along by force
+// times the distance moved in cells, the right button pours in source smoke
+const float force = 1.0, source = 1.0;
 
 // Initial density
 float DensityFunc(float x, float y) {
@@ -33,8 +63,8 @@ float DensityFunc(float x, float y) {
 // Initial velocity
 void VelocityFunc(float &u, float &v, float x, float y) {
 	float dx = .5 - (float) x/height, dy = .5 - (float) y/height;
-	u = rand()%11-5;
-	v = rand()%11-5;
+	u = (int) (CellRandom(x, y, 0, seed)%11) - 5;
+	v = (int) (CellRandom(x, y, 1, seed)%11) - 5;
 }
 
 /****************************************************************************************************************/
@@ -49,19 +79,53 @@ void quit(int);
 void quit(int, const char*);
 
 void UploadAndRender();
+void LoadState(const char*);
 void PopulateGrids();
+void PopulateRows(int, int, double (*)[3]);
 void HandleEvents();
-void UpdatePixels(float*);
+void Interact(const SDL_Event&);
+void SolverLoop();
+void Output();
+
+struct Frame;
+struct Span;
+void UpdatePixels(Frame*);
+void PublishFrame();
+Frame *LatestFrame();
 
 void DensityStep();
 void VelocityStep();
 
+void LoadObstacles(const char*);
+void CompileObstacles();
+
+void PlanSpectral();
+void SolveSpectral(float*, float*);
+
+void PlanCG();
+void SolveCG(float*, float*);
+double (*RowSums())[3];
+void Reduce(double (*)[3], double*, int);
+
+void StartWorkers();
+void FindNode();
+void PinWorker();
+void StopWorkers();
+void Simulate();
+void Sync();
+void Spin();
+void Publish();
+void WaitNeighbours();
+
+void Relax(int, float*, float*, float, float);
+void RelaxSpans(const Span*, const Span*, int, float*, float*, float, float);
 void Diffuse(int, float*, float*, float);
 void Advect(int, float*, float*, float*, float*);
 void Project(float*, float*, float*, float*);
 void SetBoundaries(float*, int);
+void SetObstacles(float*, int);
 
-bool running = true;
+std::atomic<bool> running(true);
 const int vieww = width * upscale, viewh = height * upscale;
 float dt = .01, initialmass = 0;
 #define size		(width+2) * (height+2)
@@ -74,22 +138,120 @@ SDL_Renderer *renderer;
 Uint32 pixels[width*height];
 SDL_Texture *texture;
 
-float u[size], u_prev[size];
-float v[size], v_prev[size];
-float dens[size], dens_prev[size];
-float img[width*height][3];
+// Simulation state lives in memory shared between the worker processes
+float *u, *u_prev;
+float *v, *v_prev;
+float *dens, *dens_prev;
+float *pres[2]; // Kept between frames, one per Project in VelocityStep
+const int FIELDS = 8;
+float img[width*height];
 long long a, b;
 
+// Frame output, the mass report moves to stderr when frames go to stdout
+FrameSink sink;
+bool writing = false;
+FILE *report = stdout;
+
+// Snapshots handed from the solver to the renderer. The solver fills
+// back, the renderer reads front, and middle is swapped between them
+// with the FRESH bit set whenever it holds a frame not yet shown.
+struct Frame {
+	float dens[size], u[size], v[size];
+};
+Frame frames[3];
+const int FRESH = 4;
+std::atomic<int> middle(1);
+int back = 0, front = 2;
+
+// Events travel from the render thread to the solver through this ring,
+// which drops them while it's full
+const unsigned QUEUE = 64;
+SDL_Event events[QUEUE];
+std::atomic<unsigned> head(0), tail(0);
+
+// Obstacles are compiled into runs of fluid cells in each row, and the
+// solid cells bordering fluid along with which of their neighbours are
+// fluid. Kernels only ever walk these lists; the red-black sweep picks
+// each colour's first cell in a run from the parity of the row and start.
+struct Span {
+	int j, lo, hi;
+};
+struct Wall {
+	int cell;
+	unsigned char flags;
+};
+enum { LEFT = 1, RIGHT = 2, DOWN = 4, UP = 8 };
+bool solid[size];
+bool obstacles = false;
+std::vector<Span> spans;
+std::vector<Wall> walls;
+// spans[innerlo, innerhi) are the rows no other strip reads
+int nspans = 0, innerlo = 0, innerhi = 0;
+
+// Spectral solver state, this worker also transforms columns [collo, colhi]
+bool spectral = false;
+FFTPlan rowplan, colplan;
+std::vector<float> roweig, coleig;
+int collo = 1, colhi = width;
+
+// Initial state read from statefile, NULL where the functions fill it in
+const float *initdens, *initu, *initv;
+std::vector<float> hdrdens;
+
+// Conjugate gradient state, the search direction is shared between strips.
+// Walls can seal the fluid into separate regions, so span sums are shared
+// too, firstspan[j] being the first span of row j over the whole grid.
+float fluid[size], diag[size], invdiag[size];
+std::vector<float> cgr, cgz, cgq;
+float *cgd;
+double *spansum;
+std::vector<int> firstspan, spanregion, regioncells;
+std::vector<double> regionmean;
+int cgspans = 0, regions = 0;
+
+// Worker state, rows [rowlo, rowhi] belong to this process. Reductions
+// go through per-row sums so they round the same for any worker count,
+// and alternate between two slots so a fast worker can't overwrite sums
+// that a slow one is still reading.
+struct Control {
+	std::atomic<int> arrived, phase;
+	std::atomic<bool> running;
+	std::atomic<unsigned> published[workers];
+	float dt;
+	double sums[2][height+1][3];
+};
+int reduction = 0;
+Control *control;
+pid_t children[workers], parent;
+// Set once every worker is running, cleared if one dies, since only then
+// can the barrier be met
+bool intact = false;
+int worker = 0, rowlo = 1, rowhi = height;
+unsigned exchanges = 0;
+#ifdef __linux__
+cpu_set_t nodecpus;
+#endif
+
 // ******
 //  Main
 // ******
-const char* name1;
-
+// Usage: NavierStokes [prefix | file.y4m | file.f32 | file.u16 | -] [every]
 int main(int argc, char **argv) {
 	if (argc > 1) {
-		name1 = argv[1];
+		int every = argc > 2 ? atoi(argv[2]) : 1;
+		if (!OpenSink(sink, argv[1], width, height, every)) quit(1, "Could not open output");
+		writing = true;
+		if (sink.f == stdout) report = stderr;
 	}
 
+	if (maskfile != NULL) LoadObstacles(maskfile);
+	if (statefile != NULL) LoadState(statefile);
+	spectral = pressure == SPECTRAL && !obstacles;
+	if (pressure == SPECTRAL && !spectral) fprintf(stderr, "Obstacles need the RELAX or CG pressure solver\n");
+
+	// Fork before SDL is initialized so the workers don't inherit it
+	StartWorkers();
+
 	// Initialize SDL stuff
 	if (SDL_Init(SDL_INIT_EVERYTHING) < 0) quit(SDLCRASH, "Could not initialize SDL");
 	SDL_CreateWindowAndRenderer(vieww, viewh, 0, &window, &renderer);
@@ -99,55 +261,82 @@ int main(int argc, char **argv) {
 	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
 
 	a = SDL_GetTicks();
-	PopulateGrids();
+	PublishFrame();
+
+	// Mainloop, the solver runs on its own thread so presenting never stalls it
+	std::thread solver(SolverLoop);
+	while (running) {
+		HandleEvents();
+		Frame *frame = LatestFrame();
+		if (frame == NULL) {
+			SDL_Delay(1);
+			continue;
+		}
+		UpdatePixels(frame);
+		UploadAndRender();
+	}
+	solver.join();
+
+	// Cleanup and quit
+	quit(0);
+}
+
 
-	int counter = 1;
-	// Mainloop
+// ********************
+//  Mainloop functions
+// ********************
+
+void SolverLoop() {
+	PinWorker();
 	while (running) {
+		// Events queued by the render thread, quitting is handled over there
+		// so it's never dropped
+		unsigned next = tail.load(std::memory_order_relaxed);
+		for (; next != head.load(std::memory_order_acquire); next++) Interact(events[next % QUEUE]);
+		tail.store(next, std::memory_order_release);
+
 		// Deltatime
 		b = a;
 		a = SDL_GetTicks();
 		dt = (a - b) / 10000.0; // Run at 1/10th speed
 
 		// Simulate the smoke
-		HandleEvents();
-		DensityStep();
-		VelocityStep();
-		UpdatePixels(dens);
-		UploadAndRender();
-		
-		// Prepare output
-		float mass = 0;
-		for (int i = 1; i <= width; i++) {
-			for (int j = 1; j <= height; j++) {
-				float p = dens[IX(i, j)];
-				mass += p;
-				img[XY(i, j)][0] = p;
-				img[XY(i, j)][1] = p;
-				img[XY(i, j)][2] = p;
-			}
-		}
+		Simulate();
+		PublishFrame();
+		Output();
+	}
+}
 
-		// Output
-		printf("%f%% mass\n", mass/initialmass * 100);
-		if (argc > 1) {
-			char name[1024];
-			sprintf(name, "%s%i.hdr", name1, counter++);
-			FILE *f = fopen(name, "wb");
-			RGBE_WriteHeader(f, width, height, NULL);
-			RGBE_WritePixels_RLE(f, (float *) img, width, height);
-			fclose(f);
+void Output() {
+	// Prepare output
+	float mass = 0;
+	for (int j = 1; j <= height; j++) {
+		for (int i = 1; i <= width; i++) {
+			float p = solid[IX(i, j)] ? 0 : dens[IX(i, j)];
+			mass += p;
+			img[XY(i, j)] = p;
 		}
 	}
-	
-	// Cleanup and quit
-	quit(0);
+
+	// Output
+	fprintf(report, "%f%% mass\n", mass/initialmass * 100);
+	if (writing) WriteFrame(sink, img);
 }
 
+void PublishFrame() {
+	Frame *frame = &frames[back];
+	std::copy(dens, dens + size, frame->dens);
+	std::copy(u, u + size, frame->u);
+	std::copy(v, v + size, frame->v);
+	back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+}
 
-// ********************
-//  Mainloop functions
-// ********************
+// Returns the newest unseen frame, or NULL if the solver hasn't produced one
+Frame *LatestFrame() {
+	if (!(middle.load(std::memory_order_relaxed) & FRESH)) return NULL;
+	front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+	return &frames[front];
+}
 
 void UploadAndRender() {
 	SDL_UpdateTexture(texture, NULL, pixels, width * sizeof(Uint32));
@@ -156,7 +345,11 @@ void UploadAndRender() {
 	SDL_RenderPresent(renderer);
 }
 
-void UpdatePixels(float *dens) {
+void UpdatePixels(Frame *frame) {
+	float *dens = frame->dens;
+	#ifdef VECCOLS
+	float *u = frame->u, *v = frame->v;
+	#endif
 	for (int y = 1; y <= height; y++) {
 		for (int x = 1; x <= width; x++) {
 			int val = dens[IX(x, y)] * 255;
@@ -174,14 +367,83 @@ void UpdatePixels(float *dens) {
 	}
 }
 
+// Maps raw state files so the workers can all copy their rows at once
+void LoadState(const char *path) {
+	const int n = width * height;
+	if (HasSuffix(path, ".hdr")) {
+		FILE *f = fopen(path, "rb");
+		if (f == NULL) quit(1, "Could not open initial state");
+		int w, h;
+		std::vector<float> rgb(n * 3);
+		if (RGBE_ReadHeader(f, &w, &h, NULL) != RGBE_RETURN_SUCCESS || w != width || h != height ||
+			RGBE_ReadPixels_RLE(f, &rgb[0], width, height) != RGBE_RETURN_SUCCESS) {
+			quit(1, "Initial state must be a width x height .hdr");
+		}
+		fclose(f);
+		hdrdens.resize(n);
+		for (int k = 0; k < n; k++) hdrdens[k] = (rgb[3*k] + rgb[3*k + 1] + rgb[3*k + 2]) / 3;
+		initdens = &hdrdens[0];
+		return;
+	}
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) quit(1, "Could not open initial state");
+	size_t plane = n * sizeof(float);
+	if (st.st_size != (off_t) plane && st.st_size != (off_t) (3 * plane)) {
+		quit(1, "Initial state must hold 1 or 3 width x height float planes");
+	}
+	void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED) quit(1, "Could not map initial state");
+	madvise(mem, st.st_size, MADV_WILLNEED);
+	initdens = (const float *) mem;
+	if (st.st_size == (off_t) (3 * plane)) {
+		initu = initdens + n;
+		initv = initu + n;
+	}
+}
+
+// Every worker fills its own rows, split again between threads. Cells
+// never depend on each other and the mass is summed per row, so the
+// result is the same however the work is divided. The calling thread
+// only waits, so worker 0's main thread is never pinned.
 void PopulateGrids() {
-	for (int y = 1; y <= height; y++) {
+	int threads = std::max(1, (int) std::thread::hardware_concurrency() / workers);
+	threads = std::min(threads, rowhi - rowlo + 1);
+	double (*sums)[3] = RowSums();
+	std::vector<std::thread> pool;
+	for (int t = 0; t < threads; t++) {
+		int lo = rowlo + (rowhi - rowlo + 1) * t / threads;
+		int hi = rowlo + (rowhi - rowlo + 1) * (t + 1) / threads - 1;
+		pool.push_back(std::thread(PopulateRows, lo, hi, sums));
+	}
+	for (std::thread &t : pool) t.join();
+
+	double mass;
+	Reduce(sums, &mass, 1);
+	initialmass = mass;
+}
+
+void PopulateRows(int lo, int hi, double (*sums)[3]) {
+	// Spread over all of the worker's node, so the first touch below
+	// places the pages there rather than wherever the thread started
+	PinWorker();
+	float *fields[] = { u, u_prev, v, v_prev, dens, dens_prev, pres[0], pres[1], cgd };
+	for (int y = lo; y <= hi; y++) {
+		for (float *f : fields) std::fill(f + IX(0, y), f + IX(width+2, y), 0.0f);
 		for (int x = 1; x <= width; x++) {
-			float rho = DensityFunc(x, y);
+			if (solid[IX(x, y)]) continue;
+			float rho = initdens ? initdens[XY(x, y)] : DensityFunc(x, y);
 			dens[IX(x, y)] = rho;
-			initialmass += rho;
+			sums[y][0] += rho;
 			float uvec, vvec;
-			VelocityFunc(uvec, vvec, x, y);
+			if (initu) {
+				uvec = initu[XY(x, y)];
+				vvec = initv[XY(x, y)];
+			} else {
+				VelocityFunc(uvec, vvec, x, y);
+			}
 			u[IX(x, y)] = uvec;
 			v[IX(x, y)] = vvec;
 		}
@@ -203,7 +465,476 @@ void HandleEvents() {
 				}
 				break;
 		}
+		unsigned next = head.load(std::memory_order_relaxed);
+		if (next - tail.load(std::memory_order_acquire) == QUEUE) continue; // Solver is behind, drop it
+		events[next % QUEUE] = event;
+		head.store(next + 1, std::memory_order_release);
+	}
+}
+
+// Runs on the solver between steps, while the other workers wait at the
+// barrier, so it can write to any of their rows
+void Interact(const SDL_Event &event) {
+	switch (event.type) {
+		case SDL_MOUSEMOTION: {
+			int i = event.motion.x / upscale + 1, j = event.motion.y / upscale + 1;
+			if (i < 1 || i > width || j < 1 || j > height || solid[IX(i, j)]) break;
+			if (event.motion.state & SDL_BUTTON_LMASK) {
+				u[IX(i, j)] += force * event.motion.xrel / upscale;
+				v[IX(i, j)] += force * event.motion.yrel / upscale;
+			}
+			if (event.motion.state & SDL_BUTTON_RMASK) dens[IX(i, j)] += source;
+			break;
+		}
+	}
+}
+
+// **********************
+//  Domain decomposition
+// **********************
+
+// The grid is split into horizontal strips, one per worker process. Every
+// field lives in a single shared mapping, so the ghost rows of a strip are
+// simply its neighbours' edge rows, and exchanging them only means waiting
+// for those neighbours. The main process is worker 0 and also renders.
+void StartWorkers() {
+	if (pressure == CG) PlanCG();
+	size_t bytes = sizeof(Control) + (FIELDS + 1) * size * sizeof(float) + cgspans * sizeof(double);
+	void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) quit(1, "Could not map the shared grid");
+	control = new (mem) Control();
+	control->running = true;
+	float *grid = (float *) (control + 1);
+	u = grid; u_prev = grid + size;
+	v = grid + 2*size; v_prev = grid + 3*size;
+	dens = grid + 4*size; dens_prev = grid + 5*size;
+	pres[0] = grid + 6*size; pres[1] = grid + 7*size;
+	cgd = grid + 8*size;
+	spansum = (double *) (grid + (FIELDS + 1) * size);
+
+	parent = getpid();
+	for (int w = 1; w < workers; w++) {
+		pid_t pid = fork();
+		if (pid < 0) quit(1, "Could not fork worker");
+		if (pid == 0) {
+			worker = w;
+			// Don't outlive the main process, however it dies
+			#ifdef __linux__
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			#endif
+			if (getppid() != parent) _exit(1);
+			break;
+		}
+		children[w] = pid;
+	}
+	intact = true;
+	rowlo = 1 + height * worker / workers;
+	rowhi = height * (worker + 1) / workers;
+	FindNode();
+
+	// Worker 0 pins its solver thread instead, leaving the renderer free
+	if (worker != 0) PinWorker();
+	CompileObstacles();
+	if (spectral) PlanSpectral();
+
+	PopulateGrids();
+
+	if (worker != 0) {
+		while (true) {
+			Sync();
+			if (!control->running) _exit(0);
+			dt = control->dt;
+			DensityStep();
+			VelocityStep();
+		}
+	}
+}
+
+// Workers are dealt out round robin over the NUMA nodes listed in sysfs.
+// Without them every CPU counts as one node.
+void FindNode() {
+	#ifdef __linux__
+	int nodes = 0;
+	char path[64];
+	for (;; nodes++) {
+		sprintf(path, "/sys/devices/system/node/node%i/cpulist", nodes);
+		if (access(path, R_OK) != 0) break;
+	}
+	CPU_ZERO(&nodecpus);
+	if (nodes == 0) {
+		for (int c = 0; c < sysconf(_SC_NPROCESSORS_ONLN); c++) CPU_SET(c, &nodecpus);
+		return;
+	}
+
+	// cpulist looks like "0-7,16-23"
+	sprintf(path, "/sys/devices/system/node/node%i/cpulist", worker % nodes);
+	FILE *f = fopen(path, "r");
+	int lo, hi, sep;
+	while (f != NULL && fscanf(f, "%d", &lo) == 1) {
+		hi = lo;
+		sep = fgetc(f);
+		if (sep == '-') {
+			if (fscanf(f, "%d", &hi) != 1) break;
+			sep = fgetc(f);
+		}
+		for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) CPU_SET(c, &nodecpus);
+		if (sep != ',') break;
+	}
+	if (f != NULL) fclose(f);
+	#endif
+}
+
+// Keep the calling thread on its strip's node, so the rows it touches
+// first live in that node's memory
+void PinWorker() {
+	#ifdef __linux__
+	if (CPU_COUNT(&nodecpus) > 0) sched_setaffinity(0, sizeof(nodecpus), &nodecpus);
+	#endif
+}
+
+void StopWorkers() {
+	if (control == NULL || worker != 0) return;
+	if (intact) {
+		control->running = false;
+		Sync();
+	}
+	for (int w = 1; w < workers; w++) {
+		if (children[w] <= 0) continue;
+		if (!intact) kill(children[w], SIGKILL);
+		waitpid(children[w], NULL, 0);
+	}
+	control = NULL;
+}
+
+void Simulate() {
+	control->dt = dt;
+	Sync();
+	DensityStep();
+	VelocityStep();
+}
+
+// Cleared sums for this worker's rows to accumulate into
+double (*RowSums())[3] {
+	double (*sums)[3] = control->sums[reduction++ & 1];
+	for (int j = rowlo; j <= rowhi; j++) sums[j][0] = sums[j][1] = sums[j][2] = 0;
+	return sums;
+}
+
+// Totals the first n sums over every row
+void Reduce(double (*sums)[3], double *v, int n) {
+	Sync();
+	for (int k = 0; k < n; k++) {
+		v[k] = 0;
+		for (int j = 1; j <= height; j++) v[k] += sums[j][k];
+	}
+}
+
+// Sense-reversing spin barrier across all the workers
+void Sync() {
+	if (workers == 1) return;
+	int phase = control->phase.load(std::memory_order_acquire);
+	if (control->arrived.fetch_add(1, std::memory_order_acq_rel) == workers - 1) {
+		control->arrived.store(0, std::memory_order_relaxed);
+		control->phase.fetch_add(1, std::memory_order_release);
+	} else {
+		while (control->phase.load(std::memory_order_acquire) == phase) Spin();
+	}
+}
+
+// Marks this worker's edge rows as done for the current half sweep
+void Publish() {
+	if (workers == 1) return;
+	control->published[worker].store(++exchanges, std::memory_order_release);
+}
+
+// Waits for just the strips either side to publish the same half sweep.
+// The counters wrap on long runs, so only their difference is compared.
+void WaitNeighbours() {
+	if (workers == 1) return;
+	if (worker > 0) {
+		while ((int) (control->published[worker-1].load(std::memory_order_acquire) - exchanges) < 0) Spin();
+	}
+	if (worker < workers - 1) {
+		while ((int) (control->published[worker+1].load(std::memory_order_acquire) - exchanges) < 0) Spin();
+	}
+}
+
+// One round of waiting on the other workers. Also catches the main process
+// going away where there's no parent death signal, and the main process
+// catches any worker that exits, as the barrier would never open again.
+void Spin() {
+	static int spins = 0;
+	if (++spins % 1024 == 0) {
+		if (worker != 0 && getppid() != parent) _exit(1);
+		pid_t pid = worker == 0 ? waitpid(-1, NULL, WNOHANG) : 0;
+		if (pid > 0) {
+			for (int w = 1; w < workers; w++) {
+				if (children[w] == pid) children[w] = 0;
+			}
+			intact = false;
+			quit(1, "A worker process exited");
+		}
+	}
+	sched_yield();
+}
+
+// ***********
+//  Obstacles
+// ***********
+
+void LoadObstacles(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) quit(1, "Could not open obstacle mask");
+	int w, h;
+	std::vector<float> rgb(width * height * 3);
+	if (RGBE_ReadHeader(f, &w, &h, NULL) != RGBE_RETURN_SUCCESS || w != width || h != height ||
+		RGBE_ReadPixels_RLE(f, &rgb[0], width, height) != RGBE_RETURN_SUCCESS) {
+		quit(1, "Obstacle mask must be a width x height .hdr");
+	}
+	fclose(f);
+
+	for (int j = 1; j <= height; j++) {
+		for (int i = 1; i <= width; i++) {
+			float *px = &rgb[3 * XY(i, j)];
+			solid[IX(i, j)] = px[0] + px[1] + px[2] > 1.5;
+			obstacles |= solid[IX(i, j)];
+		}
+	}
+}
+
+// Builds the spans and walls for this worker's rows, once at startup
+void CompileObstacles() {
+	spans.clear();
+	nspans = innerlo = innerhi = 0;
+	walls.clear();
+	for (int j = rowlo; j <= rowhi; j++) {
+		for (int i = 1; i <= width; i++) {
+			if (!solid[IX(i, j)]) {
+				int lo = i;
+				while (i < width && !solid[IX(i+1, j)]) i++;
+				Span span = { j, lo, i };
+				spans.push_back(span);
+				if (j == rowlo) innerlo = ++nspans;
+				else if (j < rowhi) innerhi = ++nspans;
+				else nspans++;
+				continue;
+			}
+			unsigned char flags = 0;
+			if (i > 1 && !solid[IX(i-1, j)]) flags |= LEFT;
+			if (i < width && !solid[IX(i+1, j)]) flags |= RIGHT;
+			if (j > 1 && !solid[IX(i, j-1)]) flags |= DOWN;
+			if (j < height && !solid[IX(i, j+1)]) flags |= UP;
+			if (flags) {
+				Wall wall = { IX(i, j), flags };
+				walls.push_back(wall);
+			}
+		}
+	}
+	innerhi = std::max(innerhi, innerlo);
+}
+
+// Solid cells take the average of their fluid neighbours, negating the
+// velocity component that points into the wall, like the outer boundary
+void SetObstacles(float *x, int b) {
+	const int stride = width + 2;
+	for (const Wall &w : walls) {
+		int c = w.cell, flags = w.flags, n = 0;
+		float sum = 0;
+		if (flags & LEFT) { sum += b==1 ? -x[c-1] : x[c-1]; n++; }
+		if (flags & RIGHT) { sum += b==1 ? -x[c+1] : x[c+1]; n++; }
+		if (flags & DOWN) { sum += b==2 ? -x[c-stride] : x[c-stride]; n++; }
+		if (flags & UP) { sum += b==2 ? -x[c+stride] : x[c+stride]; n++; }
+		x[c] = sum / n;
+	}
+}
+
+// *******************
+//  Spectral pressure
+// *******************
+
+// With the copy boundaries SetBoundaries gives pressure, the cosine modes
+// diagonalize the 5-point Laplacian, so a 2D DCT solves Relax's system
+// exactly. Rows and columns are split between the workers.
+void PlanSpectral() {
+	PlanFFT(rowplan, width);
+	PlanFFT(colplan, height);
+	roweig.resize(width);
+	coleig.resize(height);
+	for (int k = 0; k < width; k++) roweig[k] = 2 - 2*cos(M_PI * k / width);
+	for (int k = 0; k < height; k++) coleig[k] = 2 - 2*cos(M_PI * k / height);
+	collo = 1 + width * worker / workers;
+	colhi = width * (worker + 1) / workers;
+}
+
+// Rows and columns are transformed in pairs, one per half of each complex FFT
+void SolveSpectral(float *p, float *div) {
+	const int stride = width + 2;
+	for (int j = rowlo; j <= rowhi; j += 2) {
+		int j1 = std::min(j + 1, rowhi);
+		DCT(rowplan, &div[IX(1, j)], &div[IX(1, j1)], 1, &p[IX(1, j)], &p[IX(1, j1)], 1);
+	}
+	Sync();
+
+	for (int i = collo; i <= colhi; i += 2) {
+		int i1 = std::min(i + 1, colhi);
+		float *c0 = &p[IX(i, 1)], *c1 = &p[IX(i1, 1)];
+		DCT(colplan, c0, c1, stride, c0, c1, stride);
+		for (int k = 0; k < height; k++) {
+			// The constant mode is free under these boundaries, pin it to 0
+			float e0 = roweig[i-1] + coleig[k], e1 = roweig[i1-1] + coleig[k];
+			c0[k * stride] = e0 == 0 ? 0 : c0[k * stride] / e0;
+			if (i1 != i) c1[k * stride] = e1 == 0 ? 0 : c1[k * stride] / e1;
+		}
+		IDCT(colplan, c0, c1, stride, c0, c1, stride);
+	}
+	Sync();
+
+	for (int j = rowlo; j <= rowhi; j += 2) {
+		int j1 = std::min(j + 1, rowhi);
+		IDCT(rowplan, &p[IX(1, j)], &p[IX(1, j1)], 1, &p[IX(1, j)], &p[IX(1, j1)], 1);
+	}
+	SetBoundaries(p, 0);
+	Sync();
+}
+
+// ***************************
+//  Conjugate gradient pressure
+// ***************************
+
+// Pressure on the fluid cells with no flow through walls or the edges of
+// the domain, so each cell only couples to its fluid neighbours. The masks
+// keep the operator free of branches. Runs once before the fork, as it
+// labels every connected region of fluid and lists the spans of the whole
+// grid in the order CompileObstacles gives each strip.
+void PlanCG() {
+	const int stride = width + 2;
+	for (int j = 1; j <= height; j++) {
+		for (int i = 1; i <= width; i++) fluid[IX(i, j)] = !solid[IX(i, j)];
+	}
+	for (int j = 1; j <= height; j++) {
+		for (int i = 1; i <= width; i++) {
+			int c = IX(i, j);
+			diag[c] = fluid[c] * (fluid[c-1] + fluid[c+1] + fluid[IX(i, j-1)] + fluid[IX(i, j+1)]);
+			invdiag[c] = diag[c] > 0 ? 1 / diag[c] : 0;
+		}
+	}
+
+	// Flood fill each region from its first unlabelled cell
+	std::vector<int> region(size, -1), stack;
+	for (int c = IX(1, 1); c <= IX(width, height); c++) {
+		if (!fluid[c] || region[c] >= 0) continue;
+		region[c] = regions;
+		regioncells.push_back(0);
+		stack.push_back(c);
+		while (!stack.empty()) {
+			int n = stack.back();
+			stack.pop_back();
+			regioncells[regions]++;
+			int next[] = { n-1, n+1, n-stride, n+stride };
+			for (int m : next) {
+				if (fluid[m] && region[m] < 0) {
+					region[m] = regions;
+					stack.push_back(m);
+				}
+			}
+		}
+		regions++;
+	}
+	regionmean.resize(regions);
+
+	firstspan.resize(height + 1);
+	for (int j = 1; j <= height; j++) {
+		firstspan[j] = cgspans;
+		for (int i = 1; i <= width; i++) {
+			if (solid[IX(i, j)]) continue;
+			spanregion.push_back(region[IX(i, j)]);
+			cgspans++;
+			while (i < width && !solid[IX(i+1, j)]) i++;
+		}
+	}
+
+	cgr.assign(size, 0);
+	cgz.assign(size, 0);
+	cgq.assign(size, 0);
+}
+
+static inline float ApplyPressure(const float *x, int c) {
+	const int stride = width + 2;
+	return diag[c]*x[c] - (fluid[c-1]*x[c-1] + fluid[c+1]*x[c+1] +
+						   fluid[c-stride]*x[c-stride] + fluid[c+stride]*x[c+stride]);
+}
+
+// Jacobi preconditioned CG, warm started from the pressure already in p
+void SolveCG(float *p, float *div) {
+	float *r = &cgr[0], *z = &cgz[0], *q = &cgq[0], *d = cgd;
+
+	// Only the walls bound the fluid, so the source has to sum to zero over
+	// each region. Every worker totals all the spans in the same order.
+	double *own = spansum + firstspan[rowlo];
+	for (int k = 0; k < nspans; k++) {
+		const Span &s = spans[k];
+		double sum = 0;
+		for (int c = IX(s.lo, s.j); c <= IX(s.hi, s.j); c++) sum += div[c];
+		own[k] = sum;
+	}
+	Sync();
+	std::fill(regionmean.begin(), regionmean.end(), 0.0);
+	for (int g = 0; g < cgspans; g++) regionmean[spanregion[g]] += spansum[g];
+	for (int n = 0; n < regions; n++) regionmean[n] /= regioncells[n];
+
+	// rz, rr, bb, cells with no fluid neighbours are left out entirely
+	double v[3];
+	double (*sums)[3] = RowSums();
+	for (int k = 0; k < nspans; k++) {
+		const Span &s = spans[k];
+		double *row = sums[s.j];
+		double mean = regionmean[spanregion[firstspan[rowlo] + k]];
+		for (int c = IX(s.lo, s.j); c <= IX(s.hi, s.j); c++) {
+			float b = diag[c] > 0 ? div[c] - mean : 0;
+			r[c] = b - ApplyPressure(p, c);
+			z[c] = r[c] * invdiag[c];
+			d[c] = z[c];
+			row[0] += r[c]*z[c]; row[1] += r[c]*r[c]; row[2] += b*b;
+		}
+	}
+	Reduce(sums, v, 3);
+
+	double rz = v[0], rr = v[1], limit = tolerance * tolerance * v[2];
+	for (int k = 0; k < maxiter && rr > limit; k++) {
+		double dq;
+		sums = RowSums();
+		for (const Span &s : spans) {
+			double *row = sums[s.j];
+			for (int c = IX(s.lo, s.j); c <= IX(s.hi, s.j); c++) {
+				q[c] = ApplyPressure(d, c);
+				row[0] += d[c]*q[c];
+			}
+		}
+		Reduce(sums, &dq, 1);
+		if (dq <= 0) break;
+
+		double alpha = rz / dq, next[2];
+		sums = RowSums();
+		for (const Span &s : spans) {
+			double *row = sums[s.j];
+			for (int c = IX(s.lo, s.j); c <= IX(s.hi, s.j); c++) {
+				p[c] += alpha * d[c];
+				r[c] -= alpha * q[c];
+				z[c] = r[c] * invdiag[c];
+				row[0] += r[c]*z[c]; row[1] += r[c]*r[c];
+			}
+		}
+		Reduce(sums, next, 2);
+
+		double beta = next[0] / rz;
+		rz = next[0]; rr = next[1];
+		for (const Span &s : spans) {
+			for (int c = IX(s.lo, s.j); c <= IX(s.hi, s.j); c++) d[c] = z[c] + beta * d[c];
+		}
+		Sync();
 	}
+	SetBoundaries(p, 0);
+	Sync();
 }
 
 // ************
@@ -220,32 +951,54 @@ void DensityStep() {
 void VelocityStep() {
 	std::swap(u, u_prev); Diffuse(1, u, u_prev, visc);
 	std::swap(v, v_prev); Diffuse(2, v, v_prev, visc);
-	Project(u, v, u_prev, v_prev);
+	Project(u, v, pres[0], v_prev);
 	std::swap(u, u_prev); std::swap(v, v_prev);
 	Advect(1, u, u_prev, u_prev, v_prev); Advect(2, v, v_prev, u_prev, v_prev);
-	Project(u, v, u_prev, v_prev);
+	Project(u, v, pres[1], v_prev);
 }
 
 
-void Diffuse(int border, float *cur, float *prev, float diff) {
-	float a = dt * diff * width * height;
+// Red-black Gauss-Seidel so that neighbouring strips never race each other.
+// Each half sweep does the edge rows first and publishes them, so that the
+// neighbours can go on while this worker relaxes its interior.
+void Relax(int border, float *x, float *x0, float a, float c) {
+	const Span *first = spans.data(), *last = first + nspans;
 	for (int k = 0; k < 20; k++) {
-		for (int x = 1; x <= width; x++) {
-			for (int y = 1; y <= height; y++) {
-				cur[IX(x, y)] = (prev[IX(x, y)] + a*(cur[IX(x-1, y)] + cur[IX(x+1, y)] +
-													 cur[IX(x, y-1)] + cur[IX(x, y+1)]))/(1+4*a);
-			}
+		for (int color = 0; color < 2; color++) {
+			// Walls read fluid across strips, so setting them needs everyone
+			bool exchange = color == 0 || !obstacles;
+			RelaxSpans(first, first + innerlo, color, x, x0, a, c);
+			RelaxSpans(first + innerhi, last, color, x, x0, a, c);
+			if (exchange) Publish();
+			RelaxSpans(first + innerlo, first + innerhi, color, x, x0, a, c);
+			if (color == 1) SetBoundaries(x, border);
+			if (exchange) WaitNeighbours();
+			else Sync();
+		}
+	}
+	Sync();
+}
+
+void RelaxSpans(const Span *first, const Span *last, int color, float *x, float *x0, float a, float c) {
+	for (const Span *s = first; s != last; s++) {
+		for (int j = s->j, i = s->lo + ((s->lo + j + color + 1) & 1); i <= s->hi; i += 2) {
+			x[IX(i, j)] = (x0[IX(i, j)] + a*(x[IX(i-1, j)] + x[IX(i+1, j)] +
+											 x[IX(i, j-1)] + x[IX(i, j+1)]))/c;
 		}
-		SetBoundaries(cur, border);
 	}
 }
 
+void Diffuse(int border, float *cur, float *prev, float diff) {
+	float a = dt * diff * width * height;
+	Relax(border, cur, prev, a, 1+4*a);
+}
+
 void Advect(int border, float *cur, float *prev, float *u, float *v) {
 	float dtx = dt * width, dty = dt * height;
 	int i0, i1, j0, j1;
 	float x, y, s0, s1, t0, t1;
-	for (int i = 1; i <= width; i++) {
-		for (int j = 1; j <= height; j++) {
+	for (const Span &s : spans) {
+		for (int j = s.j, i = s.lo; i <= s.hi; i++) {
 			float x = i-dtx*u[IX(i, j)], y = j-dty*v[IX(i, j)];
 			if (x < 0.5) x = 0.5; if (x > width + 0.5) x = width + 0.5;
 			i0 = (int) x; i1 = i0 + 1;
@@ -256,48 +1009,51 @@ void Advect(int border, float *cur, float *prev, float *u, float *v) {
 							s1*(t0*prev[IX(i1, j0)] + t1*prev[IX(i1, j1)]);
 		}
 	}
-	SetBoundaries(cur, border); 
+	SetBoundaries(cur, border);
+	Sync();
 }
 
 void Project(float *u, float *v, float *p, float *div) {
 	float x = 1.0/width, y = 1.0/height;
 
-	for (int i = 1; i <= width ; i++) { 
-		for (int j = 1; j <= height; j++) { 
-			div[IX(i,j)] = -0.5*x*(u[IX(i+1,j)]-u[IX(i-1,j)]+ 
-			v[IX(i,j+1)]-v[IX(i,j-1)]); 
-			p[IX(i,j)] = 0; 
-		} 
-	} 
-	SetBoundaries(div, 0); SetBoundaries(p, 0); 
-	 
-	for (int k = 0; k < 20; k++) { 
-		for (int i = 1; i <= width; i++) { 
-			for (int j = 1; j <= height; j++) { 
-				p[IX(i,j)] = (div[IX(i,j)]+p[IX(i-1,j)]+p[IX(i+1,j)]+ 
-				p[IX(i,j-1)]+p[IX(i,j+1)])/4; 
-			} 
-		} 
-		SetBoundaries(p, 0); 
-	} 
-	 
-	for (int i = 1; i <= width; i++) { 
-		for (int j = 1; j <= height; j++) { 
-			u[IX(i,j)] -= 0.5*(p[IX(i+1,j)]-p[IX(i-1,j)])/x; 
-			v[IX(i,j)] -= 0.5*(p[IX(i,j+1)]-p[IX(i,j-1)])/y; 
-		} 
-	} 
-	SetBoundaries(u, 1); SetBoundaries(v, 2); 
-}
-
-void SetBoundaries(float *dens, int b) { 
-	for (int y = 1; y <= height ; y++) { 
-		dens[IX(0, y)] = b==1 ? -dens[IX(1, y)] : dens[IX(1, y)]; 
-		dens[IX(width+1, y)] = b==1 ? -dens[IX(width, y)] : dens[IX(width, y)]; 
+	for (const Span &s : spans) {
+		for (int j = s.j, i = s.lo; i <= s.hi; i++) {
+			div[IX(i,j)] = -0.5*x*(u[IX(i+1,j)]-u[IX(i-1,j)]+
+			v[IX(i,j+1)]-v[IX(i,j-1)]);
+			if (pressure != CG) p[IX(i,j)] = 0;
+		}
+	}
+	SetBoundaries(div, 0); SetBoundaries(p, 0);
+	Sync();
+
+	if (spectral) SolveSpectral(p, div);
+	else if (pressure == CG) SolveCG(p, div);
+	else Relax(0, p, div, 1, 4);
+
+	for (const Span &s : spans) {
+		for (int j = s.j, i = s.lo; i <= s.hi; i++) {
+			u[IX(i,j)] -= 0.5*(p[IX(i+1,j)]-p[IX(i-1,j)])/x;
+			v[IX(i,j)] -= 0.5*(p[IX(i,j+1)]-p[IX(i,j-1)])/y;
+		}
+	}
+	SetBoundaries(u, 1); SetBoundaries(v, 2);
+	Sync();
+}
+
+// Each worker only writes the ghost cells next to its own rows. Obstacle
+// walls read fluid across strips, so they wait for the neighbours first.
+void SetBoundaries(float *dens, int b) {
+	if (obstacles) {
+		Sync();
+		SetObstacles(dens, b);
+	}
+	for (int y = rowlo; y <= rowhi; y++) {
+		dens[IX(0, y)] = b==1 ? -dens[IX(1, y)] : dens[IX(1, y)];
+		dens[IX(width+1, y)] = b==1 ? -dens[IX(width, y)] : dens[IX(width, y)];
 	}
 	for (int x = 1; x <= width; x++) {
-		dens[IX(x, 0)] = b==2 ? -dens[IX(x, 1)] : dens[IX(x, 1)];
-		dens[IX(x, height+1)] = b==2 ? -dens[IX(x, height)] : dens[IX(x, height)];
+		if (rowlo == 1) dens[IX(x, 0)] = b==2 ? -dens[IX(x, 1)] : dens[IX(x, 1)];
+		if (rowhi == height) dens[IX(x, height+1)] = b==2 ? -dens[IX(x, height)] : dens[IX(x, height)];
 	}
 }
 
@@ -314,6 +1070,8 @@ void quit(int rc, const char* message) {
 			fprintf(stderr, "%s\n", SDL_GetError());
 		}
 	}
+	StopWorkers();
+	if (writing) CloseSink(sink);
 	SDL_Quit();
 	exit(rc);
 }
\ No newline at end of file